@@ -0,0 +1,96 @@
+// Replays a recorded trace through the light filter and rules.
+//
+// Each line of a trace is one of:
+//   # comment
+//   filter average|median <window>  Resets the filter.
+//   rules <bright> <dark> <hold>     Resets the rules.
+//   <reading>                        Feeds one raw reading.
+//   expect bright|dark|unknown       Checks the current level.
+//   changes <count>                  Checks the number of level changes so far.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "light_rules.h"
+
+#define MAX_LINE 128
+
+static const char* level_name(LightLevel level) {
+  switch (level) {
+    case LIGHT_LEVEL_BRIGHT:
+      return "bright";
+    case LIGHT_LEVEL_DARK:
+      return "dark";
+    default:
+      return "unknown";
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+    return 2;
+  }
+  FILE* file = fopen(argv[1], "r");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open trace: %s\n", argv[1]);
+    return 2;
+  }
+
+  LightFilter filter;
+  light_filter_init(&filter, LIGHT_FILTER_MOVING_AVERAGE, 1);
+  const LightRuleConfig default_config = {
+      .bright_threshold = 3000, .dark_threshold = 1000, .hold_samples = 1};
+  LightRules rules;
+  light_rules_init(&rules, &default_config);
+
+  char line[MAX_LINE];
+  int line_number = 0;
+  int changes = 0;
+  int failures = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    ++line_number;
+    char word[16];
+    char arg[16];
+    unsigned int a, b, c;
+    if (line[0] == '#' || sscanf(line, "%15s", word) != 1) {
+      continue;
+    }
+
+    if (sscanf(line, "filter %15s %u", arg, &a) == 2) {
+      light_filter_init(
+          &filter,
+          strcmp(arg, "median") == 0 ? LIGHT_FILTER_MEDIAN
+                                     : LIGHT_FILTER_MOVING_AVERAGE,
+          (uint16_t)a);
+    } else if (sscanf(line, "rules %u %u %u", &a, &b, &c) == 3) {
+      const LightRuleConfig config = {.bright_threshold = (uint16_t)a,
+                                      .dark_threshold = (uint16_t)b,
+                                      .hold_samples = (uint16_t)c};
+      light_rules_init(&rules, &config);
+    } else if (sscanf(line, "expect %15s", arg) == 1) {
+      if (strcmp(arg, level_name(rules.level)) != 0) {
+        fprintf(stderr, "%s:%d: expected %s, got %s\n", argv[1], line_number,
+                arg, level_name(rules.level));
+        ++failures;
+      }
+    } else if (sscanf(line, "changes %u", &a) == 1) {
+      if ((int)a != changes) {
+        fprintf(stderr, "%s:%d: expected %u changes, got %d\n", argv[1],
+                line_number, a, changes);
+        ++failures;
+      }
+    } else if (sscanf(line, "%u", &a) == 1) {
+      const uint16_t filtered = light_filter_update(&filter, (uint16_t)a);
+      if (light_rules_update(&rules, filtered)) {
+        ++changes;
+      }
+    } else {
+      fprintf(stderr, "%s:%d: unknown line: %s", argv[1], line_number, line);
+      ++failures;
+    }
+  }
+  fclose(file);
+  return failures == 0 ? 0 : 1;
+}
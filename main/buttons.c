@@ -0,0 +1,308 @@
+#include "buttons.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "stepper.h"
+
+#define TAG CONFIG_LOGGING_TAG
+#define STACK_SIZE 4096
+#define QUEUE_LENGTH 16
+#define DEBOUNCE_US (CONFIG_BUTTON_DEBOUNCE_MS * 1000LL)
+#define LONG_PRESS_US (CONFIG_BUTTON_LONG_PRESS_MS * 1000LL)
+#define DOUBLE_PRESS_US (CONFIG_BUTTON_DOUBLE_PRESS_MS * 1000LL)
+// A double press stops the step move started by the first press. The preset
+// is retried until the stepper task has finished that move.
+#define PRESET_RETRY_US (10 * 1000LL)
+#define PRESET_TIMEOUT_US (1000 * 1000LL)
+#define NO_DEADLINE INT64_MAX
+
+typedef enum {
+  BUTTON_UP,
+  BUTTON_DOWN,
+  BUTTON_STOP,
+  NUM_BUTTONS,
+} ButtonId;
+
+typedef struct {
+  ButtonId id;
+  int64_t time_us;
+} ButtonEvent;
+
+typedef struct {
+  const ButtonId id;
+  const gpio_num_t gpio;
+  Context* context;
+
+  // Only touched by the ISR.
+  int64_t last_edge_us;
+
+  // Only touched by the button task.
+  bool pressed;       // Debounced level
+  bool settling;      // An edge was seen and the level needs to be re-read
+  int64_t settle_us;  // When the level is expected to be stable
+  int64_t press_us;
+  int64_t release_us;
+  bool held;          // The current press was used as a long or double press
+  bool travelling;    // The long press started a move that release stops
+  bool stepped;       // The last release started a step move
+  bool preset_pending;
+  int64_t preset_retry_us;
+  int64_t preset_until_us;
+} Button;
+
+static QueueHandle_t button_queue = NULL;
+
+static Button buttons[NUM_BUTTONS] = {
+    {.id = BUTTON_UP, .gpio = CONFIG_BUTTON_UP_GPIO},
+    {.id = BUTTON_DOWN, .gpio = CONFIG_BUTTON_DOWN_GPIO},
+    {.id = BUTTON_STOP, .gpio = CONFIG_BUTTON_STOP_GPIO},
+};
+
+static void IRAM_ATTR button_isr_handler(void* arg) {
+  Button* const button = (Button*)arg;
+  const int64_t now_us = esp_timer_get_time();
+
+  // Stopping is idempotent, so act on the first pressed edge without waiting
+  // for the contacts to settle. Release edges must not stop anything, moves
+  // may have been started while stop was held.
+  if (button->id == BUTTON_STOP && gpio_get_level(button->gpio) == 0) {
+    button->context->stop_requested = true;
+  }
+
+  // Edges within the debounce window are bounces of the one already queued.
+  // The task re-reads the level once the window has passed.
+  if (now_us - button->last_edge_us < DEBOUNCE_US) {
+    return;
+  }
+  button->last_edge_us = now_us;
+
+  const ButtonEvent event = {.id = button->id, .time_us = now_us};
+  BaseType_t higher_priority_task_woken = pdFALSE;
+  xQueueSendFromISR(button_queue, &event, &higher_priority_task_woken);
+  if (higher_priority_task_woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+static int32_t direction(const Button* button) {
+  return button->id == BUTTON_UP ? 1 : -1;
+}
+
+// Short press. Moves by one step size, without leaving [0, max_steps] once the
+// state is initialized.
+static void step_move(Button* button) {
+  log_move_error("Button step",
+                 try_move_steps_clamped(
+                     button->context,
+                     direction(button) * CONFIG_BUTTON_STEP_SIZE));
+}
+
+// Long press. Travels to the limit, or by CONFIG_BUTTON_TRAVEL_STEPS if the
+// limits are unknown or stop is held. The latter moves past the limits and
+// extends max_steps, to calibrate the blind.
+static void start_travel(Button* button) {
+  Context* const context = button->context;
+  const bool calibrate = buttons[BUTTON_STOP].pressed;
+  esp_err_t err = ESP_ERR_INVALID_STATE;
+  if (!calibrate) {
+    err = try_move_to_fraction(context, button->id == BUTTON_UP ? 1.0 : 0.0);
+  }
+  if (err == ESP_ERR_INVALID_STATE) {
+    err = try_move_steps(context,
+                         direction(button) * CONFIG_BUTTON_TRAVEL_STEPS);
+  }
+  log_move_error("Button travel", err);
+  button->travelling = err == ESP_OK;
+}
+
+// Double press. Retried from process_button while the stepper is busy.
+static void preset_move(Button* button, int64_t now_us) {
+  const int preset = button->id == BUTTON_UP ? CONFIG_BUTTON_UP_PRESET
+                                             : CONFIG_BUTTON_DOWN_PRESET;
+  const esp_err_t err =
+      try_move_to_fraction(button->context, preset / 100.0);
+  if (err == ESP_ERR_TIMEOUT && now_us < button->preset_until_us) {
+    button->preset_retry_us = now_us + PRESET_RETRY_US;
+    return;
+  }
+  button->preset_pending = false;
+  log_move_error("Button preset", err);
+}
+
+static void on_press(Button* button, int64_t now_us) {
+  button->press_us = now_us;
+  if (button->id == BUTTON_STOP) {
+    stop_stepper(button->context);
+    return;
+  }
+  if (button->stepped && now_us - button->release_us < DOUBLE_PRESS_US) {
+    // Second press. Replace the step move with the preset.
+    button->stepped = false;
+    button->held = true;
+    stop_stepper(button->context);
+    button->preset_pending = true;
+    button->preset_until_us = now_us + PRESET_TIMEOUT_US;
+    preset_move(button, now_us);
+  }
+}
+
+static void on_release(Button* button, int64_t now_us) {
+  if (button->id == BUTTON_STOP) {
+    // Releasing stop ends a calibration travel started while it was held.
+    if (buttons[BUTTON_UP].travelling || buttons[BUTTON_DOWN].travelling) {
+      buttons[BUTTON_UP].travelling = false;
+      buttons[BUTTON_DOWN].travelling = false;
+      stop_stepper(button->context);
+    }
+    return;
+  }
+  if (button->held) {
+    button->held = false;
+    if (button->travelling) {
+      stop_stepper(button->context);
+      button->travelling = false;
+    }
+    return;
+  }
+  // Move right away instead of waiting out the double press window. A second
+  // press stops this move.
+  button->release_us = now_us;
+  button->stepped = true;
+  step_move(button);
+}
+
+static void process_button(Button* button, int64_t now_us) {
+  if (button->settling && now_us >= button->settle_us) {
+    button->settling = false;
+    const bool pressed = gpio_get_level(button->gpio) == 0;
+    if (pressed != button->pressed) {
+      button->pressed = pressed;
+      if (pressed) {
+        on_press(button, now_us);
+      } else {
+        on_release(button, now_us);
+      }
+    }
+  }
+
+  if (button->id == BUTTON_STOP) {
+    return;
+  }
+
+  if (button->pressed && !button->held &&
+      now_us - button->press_us >= LONG_PRESS_US) {
+    button->held = true;
+    button->stepped = false;
+    start_travel(button);
+  }
+
+  if (button->preset_pending && now_us >= button->preset_retry_us) {
+    preset_move(button, now_us);
+  }
+}
+
+static int64_t next_deadline(const Button* button) {
+  int64_t deadline = NO_DEADLINE;
+  if (button->settling) {
+    deadline = MIN(deadline, button->settle_us);
+  }
+  if (button->id == BUTTON_STOP) {
+    return deadline;
+  }
+  if (button->pressed && !button->held) {
+    deadline = MIN(deadline, button->press_us + LONG_PRESS_US);
+  }
+  if (button->preset_pending) {
+    deadline = MIN(deadline, button->preset_retry_us);
+  }
+  return deadline;
+}
+
+void button_task(void* parameter) {
+  while (true) {
+    int64_t deadline = NO_DEADLINE;
+    for (int i = 0; i < NUM_BUTTONS; ++i) {
+      deadline = MIN(deadline, next_deadline(&buttons[i]));
+    }
+    TickType_t timeout = portMAX_DELAY;
+    if (deadline != NO_DEADLINE) {
+      const int64_t wait_us = MAX(deadline - esp_timer_get_time(), 0);
+      // Round up so the deadline has passed when the wait times out.
+      timeout = pdMS_TO_TICKS((wait_us + 999) / 1000) + 1;
+    }
+
+    ButtonEvent event;
+    if (xQueueReceive(button_queue, &event, timeout) == pdTRUE) {
+      Button* const button = &buttons[event.id];
+      button->settling = true;
+      button->settle_us = event.time_us + DEBOUNCE_US;
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    for (int i = 0; i < NUM_BUTTONS; ++i) {
+      process_button(&buttons[i], now_us);
+    }
+  }
+}
+
+esp_err_t start_button_task(Context* const context) {
+  if (context == NULL) {
+    return ESP_FAIL;
+  }
+
+  button_queue = xQueueCreate(QUEUE_LENGTH, sizeof(ButtonEvent));
+  if (button_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create button queue");
+    return ESP_FAIL;
+  }
+
+  uint64_t pin_bit_mask = 0;
+  for (int i = 0; i < NUM_BUTTONS; ++i) {
+    buttons[i].context = context;
+    buttons[i].last_edge_us = -DEBOUNCE_US;
+    pin_bit_mask |= 1ULL << buttons[i].gpio;
+  }
+  const gpio_config_t config = {.pin_bit_mask = pin_bit_mask,
+                                .mode = GPIO_MODE_INPUT,
+                                .pull_up_en = GPIO_PULLUP_ENABLE,
+                                .pull_down_en = GPIO_PULLDOWN_DISABLE,
+                                .intr_type = GPIO_INTR_ANYEDGE};
+  esp_err_t err = gpio_config(&config);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to configure button GPIOs");
+    return err;
+  }
+
+  TaskHandle_t task_handle = NULL;
+  xTaskCreate(&button_task, "button_task", STACK_SIZE, NULL,
+              configMAX_PRIORITIES - 3, &task_handle);
+  if (task_handle == NULL) {
+    ESP_LOGE(TAG, "Failed to create button task");
+    return ESP_FAIL;
+  }
+
+  err = gpio_install_isr_service(/*intr_alloc_flags=*/0);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG, "Failed to install GPIO ISR service");
+    return err;
+  }
+  for (int i = 0; i < NUM_BUTTONS; ++i) {
+    err = gpio_isr_handler_add(buttons[i].gpio, &button_isr_handler,
+                               &buttons[i]);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to add ISR for GPIO %d", buttons[i].gpio);
+      return err;
+    }
+  }
+  return ESP_OK;
+}
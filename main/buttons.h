@@ -0,0 +1,20 @@
+#ifndef BUTTONS_H_
+#define BUTTONS_H_
+
+#include "esp_err.h"
+#include "stepper.h"
+
+// Starts the task handling the up, down and stop buttons. Buttons are active
+// low with the internal pull-ups enabled.
+//
+//  * Short press of up or down moves by CONFIG_BUTTON_STEP_SIZE steps as soon
+//    as it is released.
+//  * Double press of up or down stops that step move and moves to the
+//    configured preset instead.
+//  * Long press of up or down travels towards the limit until released.
+//  * Long press of up or down while holding stop travels past the limits to
+//    calibrate, until either button is released.
+//  * Stop ends the current move as soon as it is pressed.
+esp_err_t start_button_task(Context* const context);
+
+#endif  // BUTTONS_H_
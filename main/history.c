@@ -0,0 +1,366 @@
+#include "history.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#define TAG CONFIG_LOGGING_TAG
+#define FILE_PATH CONFIG_HISTORY_FILE_PATH
+#define CAPACITY CONFIG_HISTORY_CAPACITY
+#define BATCH_SIZE CONFIG_HISTORY_BATCH_SIZE
+#define FLUSH_INTERVAL_MS (CONFIG_HISTORY_FLUSH_INTERVAL_S * 1000)
+#define STACK_SIZE 4096
+#define READ_CHUNK 32
+
+#define HISTORY_MAGIC 0x32545348  // "HST2"
+#define INTERRUPTED_BIT (1UL << 31)
+#define TIME_DELTA_MASK (INTERRUPTED_BIT - 1)
+
+// The file is a header followed by CAPACITY fixed size records used as a ring.
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t base_time;  // Timestamp the oldest record's delta is relative to
+  uint32_t last_time;  // Timestamp of the newest record
+  uint32_t sequence;   // Number of records ever written, lets readers tell
+                       // whether the records they are after were overwritten
+  uint16_t capacity;
+  uint16_t head;  // Slot the next record is written to
+  uint16_t count;
+  uint16_t reserved;
+} HistoryHeader;
+
+// Timestamps are stored as the delta from the previous record, and the end
+// step as the delta from the start step.
+typedef struct __attribute__((packed)) {
+  uint32_t time_delta;  // Seconds since the previous record. Top bit is set
+                        // if the move was interrupted.
+  int16_t start_step;
+  int16_t step_delta;
+  uint16_t duration_cs;  // Centiseconds, saturated
+} HistoryRecord;
+
+static QueueHandle_t history_queue = NULL;
+// Guards the file between the history task and readers.
+static SemaphoreHandle_t file_mutex = NULL;
+
+static long slot_offset(uint16_t slot) {
+  return sizeof(HistoryHeader) + (long)slot * sizeof(HistoryRecord);
+}
+
+static uint16_t oldest_slot(const HistoryHeader* header) {
+  return (header->head + CAPACITY - header->count) % CAPACITY;
+}
+
+static bool header_valid(const HistoryHeader* header) {
+  return header->magic == HISTORY_MAGIC && header->capacity == CAPACITY &&
+         header->head < CAPACITY && header->count <= CAPACITY;
+}
+
+static esp_err_t read_header(FILE* file, HistoryHeader* header) {
+  if (fseek(file, 0, SEEK_SET) != 0 ||
+      fread(header, sizeof(HistoryHeader), /*nmemb=*/1, file) != 1) {
+    return ESP_FAIL;
+  }
+  return header_valid(header) ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+static esp_err_t write_header(FILE* file, const HistoryHeader* header) {
+  if (fseek(file, 0, SEEK_SET) != 0 ||
+      fwrite(header, sizeof(HistoryHeader), /*nmemb=*/1, file) != 1) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+// Makes sure the header is on flash before anything after it is written.
+static esp_err_t sync_header(FILE* file, const HistoryHeader* header) {
+  esp_err_t err = write_header(file, header);
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    return errno;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t init_history_file(void) {
+  FILE* file = fopen(FILE_PATH, "rb");
+  if (file != NULL) {
+    HistoryHeader header;
+    const esp_err_t err = read_header(file, &header);
+    fclose(file);
+    if (err == ESP_OK) {
+      ESP_LOGI(TAG, "History has %d records", header.count);
+      return ESP_OK;
+    }
+    ESP_LOGE(TAG, "Invalid history file, starting a new one");
+  }
+
+  file = fopen(FILE_PATH, "wb");
+  if (file == NULL) {
+    ESP_LOGE(TAG, "Failed to create file: %s", FILE_PATH);
+    return errno;
+  }
+  const HistoryHeader header = {.magic = HISTORY_MAGIC, .capacity = CAPACITY};
+  const esp_err_t err = write_header(file, &header);
+  if (fclose(file) != 0) {
+    return errno;
+  }
+  return err;
+}
+
+static HistoryRecord encode(const MoveRecord* move, uint32_t timestamp,
+                            uint32_t last_time) {
+  const uint32_t duration_cs = MIN(move->duration_ms / 10, UINT16_MAX);
+  return (HistoryRecord){
+      .time_delta = ((timestamp - last_time) & TIME_DELTA_MASK) |
+                    (move->interrupted ? INTERRUPTED_BIT : 0),
+      .start_step = move->start_step,
+      .step_delta = move->end_step - move->start_step,
+      .duration_cs = duration_cs};
+}
+
+static MoveRecord decode(const HistoryRecord* record, uint32_t timestamp) {
+  return (MoveRecord){
+      .timestamp = timestamp,
+      .start_step = record->start_step,
+      .end_step = record->start_step + record->step_delta,
+      .duration_ms = record->duration_cs * 10,
+      .interrupted = (record->time_delta & INTERRUPTED_BIT) != 0};
+}
+
+// Appends the moves to the ring with one open and at most two header writes.
+static esp_err_t write_batch(const MoveRecord* moves, size_t num_moves) {
+  xSemaphoreTake(file_mutex, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  FILE* file = fopen(FILE_PATH, "r+b");
+  if (file == NULL) {
+    ESP_LOGE(TAG, "Failed to open file for write: %s", FILE_PATH);
+    xSemaphoreGive(file_mutex);
+    return errno;
+  }
+
+  HistoryHeader header;
+  if ((err = read_header(file, &header)) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read history header");
+    goto done;
+  }
+
+  // Drop the oldest records that are about to be overwritten, and persist
+  // the header before any of them is. A power loss in the middle of the batch
+  // then leaves slots the header doesn't cover, instead of a base_time that is
+  // out of step with the records. The batch is never larger than the ring.
+  const int num_evicted = (int)header.count + (int)num_moves - CAPACITY;
+  if (num_evicted > 0) {
+    uint16_t slot = oldest_slot(&header);
+    for (int i = 0; i < num_evicted; ++i) {
+      HistoryRecord oldest;
+      if (fseek(file, slot_offset(slot), SEEK_SET) != 0 ||
+          fread(&oldest, sizeof(oldest), /*nmemb=*/1, file) != 1) {
+        ESP_LOGE(TAG, "Failed to read history record");
+        err = ESP_FAIL;
+        goto done;
+      }
+      header.base_time += oldest.time_delta & TIME_DELTA_MASK;
+      slot = (slot + 1) % CAPACITY;
+    }
+    header.count -= num_evicted;
+    if ((err = sync_header(file, &header)) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to write history header");
+      goto done;
+    }
+  }
+
+  for (size_t i = 0; i < num_moves; ++i) {
+    // The clock goes backwards if it is synced after a move was logged. Keep
+    // the deltas non-negative.
+    const uint32_t timestamp = MAX((uint32_t)moves[i].timestamp,
+                                   header.last_time);
+
+    const HistoryRecord record = encode(&moves[i], timestamp, header.last_time);
+    if (fseek(file, slot_offset(header.head), SEEK_SET) != 0 ||
+        fwrite(&record, sizeof(record), /*nmemb=*/1, file) != 1) {
+      ESP_LOGE(TAG, "Failed to write history record");
+      err = ESP_FAIL;
+      goto done;
+    }
+    header.head = (header.head + 1) % CAPACITY;
+    ++header.count;
+    ++header.sequence;
+    header.last_time = timestamp;
+  }
+
+  err = write_header(file, &header);
+
+done:
+  if (fclose(file) != 0 && err == ESP_OK) {
+    err = errno;
+  }
+  xSemaphoreGive(file_mutex);
+  return err;
+}
+
+void history_task(void* parameter) {
+  MoveRecord batch[BATCH_SIZE];
+  size_t num_pending = 0;
+  TickType_t first_pending_tick = 0;
+
+  while (true) {
+    TickType_t timeout = portMAX_DELAY;
+    if (num_pending > 0) {
+      const TickType_t waited = xTaskGetTickCount() - first_pending_tick;
+      const TickType_t interval = pdMS_TO_TICKS(FLUSH_INTERVAL_MS);
+      timeout = waited >= interval ? 0 : interval - waited;
+    }
+
+    if (xQueueReceive(history_queue, &batch[num_pending], timeout) == pdTRUE) {
+      if (num_pending == 0) {
+        first_pending_tick = xTaskGetTickCount();
+      }
+      ++num_pending;
+      if (num_pending < BATCH_SIZE) {
+        continue;
+      }
+    }
+    if (num_pending == 0) {
+      continue;
+    }
+
+    const esp_err_t err = write_batch(batch, num_pending);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to write %d moves to history", (int)num_pending);
+    }
+    num_pending = 0;
+  }
+}
+
+esp_err_t start_history_task(void) {
+  file_mutex = xSemaphoreCreateMutex();
+  history_queue = xQueueCreate(BATCH_SIZE * 2, sizeof(MoveRecord));
+  if (file_mutex == NULL || history_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create history queue");
+    return ESP_FAIL;
+  }
+
+  const esp_err_t err = init_history_file();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  TaskHandle_t task_handle = NULL;
+  xTaskCreate(&history_task, "history_task", STACK_SIZE, NULL,
+              tskIDLE_PRIORITY + 1, &task_handle);
+  if (task_handle == NULL) {
+    ESP_LOGE(TAG, "Failed to create history task");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t log_move(const MoveRecord* record) {
+  if (history_queue == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (xQueueSend(history_queue, record, (TickType_t)0) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  return ESP_OK;
+}
+
+// Reads records starting at slot under the mutex, after checking that the
+// record with sequence number `sequence` is still in the ring.
+static esp_err_t read_chunk(uint32_t sequence, uint16_t slot,
+                            uint16_t num_records, HistoryRecord* chunk) {
+  xSemaphoreTake(file_mutex, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  FILE* file = fopen(FILE_PATH, "rb");
+  if (file == NULL) {
+    ESP_LOGE(TAG, "Failed to open file: %s", FILE_PATH);
+    xSemaphoreGive(file_mutex);
+    return errno;
+  }
+
+  HistoryHeader header;
+  if ((err = read_header(file, &header)) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read history header");
+  } else if (sequence < header.sequence - header.count) {
+    ESP_LOGE(TAG, "History was overwritten while reading it");
+    err = ESP_ERR_INVALID_STATE;
+  } else if (fseek(file, slot_offset(slot), SEEK_SET) != 0 ||
+             fread(chunk, sizeof(HistoryRecord), num_records, file) !=
+                 num_records) {
+    ESP_LOGE(TAG, "Failed to read history records");
+    err = ESP_FAIL;
+  }
+
+  fclose(file);
+  xSemaphoreGive(file_mutex);
+  return err;
+}
+
+esp_err_t read_history(time_t from, time_t to, HistoryCallback callback,
+                       void* arg) {
+  if (file_mutex == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Snapshot of the records to read. Moves written while reading are left
+  // out.
+  HistoryHeader header;
+  xSemaphoreTake(file_mutex, portMAX_DELAY);
+  esp_err_t err = ESP_FAIL;
+  FILE* file = fopen(FILE_PATH, "rb");
+  if (file != NULL) {
+    err = read_header(file, &header);
+    fclose(file);
+  }
+  xSemaphoreGive(file_mutex);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read history header");
+    return err;
+  }
+
+  // The mutex is only held while reading a chunk, so callbacks sending the
+  // records over the network don't hold up write_batch.
+  HistoryRecord chunk[READ_CHUNK];
+  uint32_t timestamp = header.base_time;
+  uint32_t sequence = header.sequence - header.count;
+  uint16_t slot = oldest_slot(&header);
+  uint16_t remaining = header.count;
+  while (remaining > 0) {
+    // Read up to the end of the file at most, the next chunk wraps around.
+    const uint16_t num_records =
+        MIN(MIN(remaining, READ_CHUNK), CAPACITY - slot);
+    if ((err = read_chunk(sequence, slot, num_records, chunk)) != ESP_OK) {
+      return err;
+    }
+    for (uint16_t i = 0; i < num_records; ++i) {
+      timestamp += chunk[i].time_delta & TIME_DELTA_MASK;
+      if (timestamp < from) {
+        continue;
+      }
+      // Timestamps never decrease, so nothing later is in range.
+      if (timestamp > to) {
+        return ESP_OK;
+      }
+      const MoveRecord move = decode(&chunk[i], timestamp);
+      if ((err = callback(&move, arg)) != ESP_OK) {
+        return err;
+      }
+    }
+    slot = (slot + num_records) % CAPACITY;
+    sequence += num_records;
+    remaining -= num_records;
+  }
+  return ESP_OK;
+}
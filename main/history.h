@@ -0,0 +1,36 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_err.h"
+
+typedef struct {
+  time_t timestamp;  // Start of the move, seconds since epoch
+  int16_t start_step;
+  int16_t end_step;
+  uint32_t duration_ms;
+  bool interrupted;  // Stopped before reaching the requested step
+} MoveRecord;
+
+// Called for each record in a range. Returning anything other than ESP_OK
+// ends the read with that error.
+typedef esp_err_t (*HistoryCallback)(const MoveRecord* record, void* arg);
+
+// Creates the history file if needed and starts the task writing batches to
+// it. Storage has to be mounted already.
+esp_err_t start_history_task(void);
+
+// Queues a completed move to be written with the next batch. Never blocks.
+// Returns ESP_ERR_TIMEOUT if the queue is full and the move is dropped.
+esp_err_t log_move(const MoveRecord* record);
+
+// Calls callback on the written records with timestamp in [from, to], oldest
+// first. Reads the file in small chunks instead of loading it into memory.
+// Moves still waiting for their batch are not included.
+esp_err_t read_history(time_t from, time_t to, HistoryCallback callback,
+                       void* arg);
+
+#endif  // HISTORY_H_
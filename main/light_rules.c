@@ -0,0 +1,92 @@
+#include "light_rules.h"
+
+#include <string.h>
+
+void light_filter_init(LightFilter* filter, LightFilterType type,
+                       uint16_t window) {
+  memset(filter, 0, sizeof(LightFilter));
+  filter->type = type;
+  if (window == 0) {
+    window = 1;
+  }
+  if (window > LIGHT_FILTER_MAX_WINDOW) {
+    window = LIGHT_FILTER_MAX_WINDOW;
+  }
+  filter->window = window;
+}
+
+static uint16_t median(const LightFilter* filter) {
+  uint16_t sorted[LIGHT_FILTER_MAX_WINDOW];
+  const uint16_t count = filter->count;
+  memcpy(sorted, filter->samples, count * sizeof(uint16_t));
+
+  // Insertion sort. The window is small enough that this is cheaper than
+  // anything fancier.
+  for (uint16_t i = 1; i < count; ++i) {
+    const uint16_t value = sorted[i];
+    uint16_t j = i;
+    while (j > 0 && sorted[j - 1] > value) {
+      sorted[j] = sorted[j - 1];
+      --j;
+    }
+    sorted[j] = value;
+  }
+
+  if (count % 2 == 1) {
+    return sorted[count / 2];
+  }
+  return (uint16_t)(((uint32_t)sorted[count / 2 - 1] + sorted[count / 2]) / 2);
+}
+
+uint16_t light_filter_update(LightFilter* filter, uint16_t sample) {
+  if (filter->count == filter->window) {
+    filter->sum -= filter->samples[filter->next];
+  } else {
+    ++filter->count;
+  }
+  filter->samples[filter->next] = sample;
+  filter->sum += sample;
+  filter->next = (filter->next + 1) % filter->window;
+
+  if (filter->type == LIGHT_FILTER_MEDIAN) {
+    return median(filter);
+  }
+  return (uint16_t)((filter->sum + filter->count / 2) / filter->count);
+}
+
+void light_rules_init(LightRules* rules, const LightRuleConfig* config) {
+  rules->config = *config;
+  rules->level = LIGHT_LEVEL_UNKNOWN;
+  rules->candidate = LIGHT_LEVEL_UNKNOWN;
+  rules->candidate_count = 0;
+}
+
+bool light_rules_update(LightRules* rules, uint16_t reading) {
+  LightLevel observed = LIGHT_LEVEL_UNKNOWN;
+  if (reading >= rules->config.bright_threshold) {
+    observed = LIGHT_LEVEL_BRIGHT;
+  } else if (reading <= rules->config.dark_threshold) {
+    observed = LIGHT_LEVEL_DARK;
+  }
+
+  // Inside the hysteresis band, or already at the observed level.
+  if (observed == LIGHT_LEVEL_UNKNOWN || observed == rules->level) {
+    rules->candidate = LIGHT_LEVEL_UNKNOWN;
+    rules->candidate_count = 0;
+    return false;
+  }
+
+  if (observed != rules->candidate) {
+    rules->candidate = observed;
+    rules->candidate_count = 0;
+  }
+  ++rules->candidate_count;
+  if (rules->candidate_count < rules->config.hold_samples) {
+    return false;
+  }
+
+  rules->level = observed;
+  rules->candidate = LIGHT_LEVEL_UNKNOWN;
+  rules->candidate_count = 0;
+  return true;
+}
@@ -0,0 +1,63 @@
+#ifndef LIGHT_RULES_H_
+#define LIGHT_RULES_H_
+
+// Filtering and threshold rules for the light sensor. This file only depends
+// on the C standard library so it can be compiled and fed recorded sample
+// traces on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LIGHT_FILTER_MAX_WINDOW 32
+
+typedef enum {
+  LIGHT_FILTER_MOVING_AVERAGE,
+  LIGHT_FILTER_MEDIAN,
+} LightFilterType;
+
+typedef struct {
+  LightFilterType type;
+  uint16_t window;  // Number of samples to filter over. At most
+                    // LIGHT_FILTER_MAX_WINDOW.
+  uint16_t count;   // Number of valid samples in the ring buffer
+  uint16_t next;    // Next slot to write in the ring buffer
+  uint32_t sum;     // Sum of the valid samples, for the moving average
+  uint16_t samples[LIGHT_FILTER_MAX_WINDOW];
+} LightFilter;
+
+typedef enum {
+  LIGHT_LEVEL_UNKNOWN,
+  LIGHT_LEVEL_DARK,
+  LIGHT_LEVEL_BRIGHT,
+} LightLevel;
+
+typedef struct {
+  // Readings at or above this are bright. Must be above dark_threshold, the
+  // gap in between is the hysteresis band.
+  uint16_t bright_threshold;
+  // Readings at or below this are dark.
+  uint16_t dark_threshold;
+  // Number of consecutive readings past a threshold before the level changes.
+  uint16_t hold_samples;
+} LightRuleConfig;
+
+typedef struct {
+  LightRuleConfig config;
+  LightLevel level;
+  LightLevel candidate;
+  uint16_t candidate_count;
+} LightRules;
+
+void light_filter_init(LightFilter* filter, LightFilterType type,
+                       uint16_t window);
+
+// Adds a sample and returns the filtered value over the samples seen so far.
+uint16_t light_filter_update(LightFilter* filter, uint16_t sample);
+
+void light_rules_init(LightRules* rules, const LightRuleConfig* config);
+
+// Feeds a filtered reading. Returns true if the light level changed, in which
+// case the new level is in rules->level.
+bool light_rules_update(LightRules* rules, uint16_t reading);
+
+#endif  // LIGHT_RULES_H_
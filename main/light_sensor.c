@@ -0,0 +1,200 @@
+#include "light_sensor.h"
+
+#include "esp_adc/adc_continuous.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "light_rules.h"
+#include "sdkconfig.h"
+#include "soc/soc_caps.h"
+#include "stepper.h"
+
+#define TAG CONFIG_LOGGING_TAG
+#define STACK_SIZE 4096
+#define FRAME_SIZE 1024
+#define MAX_STORE_BUF_SIZE (FRAME_SIZE * 4)
+
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type1.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type1.data)
+#else
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type2.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type2.data)
+#endif
+
+#if CONFIG_LIGHT_FILTER_MEDIAN
+#define FILTER_TYPE LIGHT_FILTER_MEDIAN
+#else
+#define FILTER_TYPE LIGHT_FILTER_MOVING_AVERAGE
+#endif
+
+static adc_continuous_handle_t adc_handle = NULL;
+static TaskHandle_t light_sensor_task_handle = NULL;
+static uint8_t frame[FRAME_SIZE];
+
+// Written by the light sensor task only. 16 bit stores are atomic, so readers
+// at worst see readings from two adjacent sample periods.
+static volatile LightReadings readings = {.valid = false,
+                                          .level = LIGHT_LEVEL_UNKNOWN};
+
+static bool IRAM_ATTR conv_done_callback(adc_continuous_handle_t handle,
+                                         const adc_continuous_evt_data_t* edata,
+                                         void* user_data) {
+  BaseType_t higher_priority_task_woken = pdFALSE;
+  vTaskNotifyGiveFromISR(light_sensor_task_handle,
+                         &higher_priority_task_woken);
+  return higher_priority_task_woken == pdTRUE;
+}
+
+static esp_err_t init_adc(void) {
+  const adc_continuous_handle_cfg_t handle_config = {
+      .max_store_buf_size = MAX_STORE_BUF_SIZE,
+      .conv_frame_size = FRAME_SIZE};
+  esp_err_t err = adc_continuous_new_handle(&handle_config, &adc_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to create ADC handle");
+    return err;
+  }
+
+  adc_digi_pattern_config_t pattern = {
+      .atten = ADC_ATTEN_DB_11,
+      .channel = CONFIG_LIGHT_SENSOR_ADC_CHANNEL & 0x7,
+      .unit = ADC_UNIT_1,
+      .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH};
+  // Run at the lowest rate the DMA supports. The samples are averaged down to
+  // one reading per sample period anyway.
+  const adc_continuous_config_t config = {
+      .pattern_num = 1,
+      .adc_pattern = &pattern,
+      .sample_freq_hz = SOC_ADC_SAMPLE_FREQ_THRES_LOW,
+      .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+      .format = ADC_OUTPUT_TYPE};
+  err = adc_continuous_config(adc_handle, &config);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to configure ADC");
+    return err;
+  }
+
+  const adc_continuous_evt_cbs_t callbacks = {.on_conv_done =
+                                                  conv_done_callback};
+  err = adc_continuous_register_event_callbacks(adc_handle, &callbacks, NULL);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to register ADC callbacks");
+    return err;
+  }
+  return adc_continuous_start(adc_handle);
+}
+
+static double position_for_level(LightLevel level) {
+  if (level == LIGHT_LEVEL_BRIGHT) {
+    return CONFIG_LIGHT_BRIGHT_POSITION / 100.0;
+  }
+  return CONFIG_LIGHT_DARK_POSITION / 100.0;
+}
+
+void light_sensor_task(void* parameter) {
+  configASSERT(parameter != NULL);
+  Context* const context = (Context*)parameter;
+
+  LightFilter filter;
+  light_filter_init(&filter, FILTER_TYPE, CONFIG_LIGHT_FILTER_WINDOW);
+  const LightRuleConfig rule_config = {
+      .bright_threshold = CONFIG_LIGHT_BRIGHT_THRESHOLD,
+      .dark_threshold = CONFIG_LIGHT_DARK_THRESHOLD,
+      .hold_samples = CONFIG_LIGHT_HOLD_SAMPLES};
+  LightRules rules;
+  light_rules_init(&rules, &rule_config);
+
+  const int64_t period_us = CONFIG_LIGHT_SAMPLE_PERIOD_MS * 1000LL;
+  int64_t next_sample_us = esp_timer_get_time() + period_us;
+  // 64 bits so long sample periods at the DMA rate can't overflow it.
+  uint64_t sum = 0;
+  uint32_t count = 0;
+  // Level whose move has not been accepted by the stepper task yet.
+  LightLevel pending = LIGHT_LEVEL_UNKNOWN;
+
+  while (true) {
+    xTaskNotifyWait(/*do not clear notification on enter*/ 0x00,
+                    /*clear notification on exit*/ ULONG_MAX,
+                    /*pulNotificationValue=*/NULL, portMAX_DELAY);
+
+    uint32_t length = 0;
+    while (adc_continuous_read(adc_handle, frame, FRAME_SIZE, &length,
+                               /*timeout_ms=*/0) == ESP_OK) {
+      for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length;
+           i += SOC_ADC_DIGI_RESULT_BYTES) {
+        const adc_digi_output_data_t* const data =
+            (const adc_digi_output_data_t*)&frame[i];
+        if (ADC_GET_CHANNEL(data) != (CONFIG_LIGHT_SENSOR_ADC_CHANNEL & 0x7)) {
+          continue;
+        }
+        sum += ADC_GET_DATA(data);
+        ++count;
+      }
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    if (now_us < next_sample_us || count == 0) {
+      continue;
+    }
+    next_sample_us = now_us + period_us;
+
+    const uint16_t raw = (uint16_t)(sum / count);
+    sum = 0;
+    count = 0;
+    const uint16_t filtered = light_filter_update(&filter, raw);
+    readings.raw = raw;
+    readings.filtered = filtered;
+    readings.valid = true;
+
+    if (light_rules_update(&rules, filtered)) {
+      ESP_LOGI(TAG, "Light level changed to %s at reading %d",
+               rules.level == LIGHT_LEVEL_BRIGHT ? "bright" : "dark",
+               filtered);
+      readings.level = rules.level;
+      pending = rules.level;
+    }
+
+    if (pending == LIGHT_LEVEL_UNKNOWN) {
+      continue;
+    }
+    const esp_err_t err =
+        try_move_to_fraction(context, position_for_level(pending));
+    if (err == ESP_ERR_TIMEOUT) {
+      // Stepper is busy. Retry on the next sample period.
+      continue;
+    }
+    log_move_error("Light rule", err);
+    pending = LIGHT_LEVEL_UNKNOWN;
+  }
+}
+
+esp_err_t start_light_sensor_task(Context* const context) {
+  if (context == NULL) {
+    return ESP_FAIL;
+  }
+  if (CONFIG_LIGHT_DARK_THRESHOLD >= CONFIG_LIGHT_BRIGHT_THRESHOLD) {
+    ESP_LOGE(TAG, "Dark threshold %d has to be below bright threshold %d",
+             CONFIG_LIGHT_DARK_THRESHOLD, CONFIG_LIGHT_BRIGHT_THRESHOLD);
+    return ESP_ERR_INVALID_ARG;
+  }
+  // The task has to exist before the ADC starts notifying it.
+  xTaskCreate(&light_sensor_task, "light_sensor_task", STACK_SIZE, context,
+              tskIDLE_PRIORITY + 1, &light_sensor_task_handle);
+  if (light_sensor_task_handle == NULL) {
+    ESP_LOGE(TAG, "Failed to create light sensor task");
+    return ESP_FAIL;
+  }
+  return init_adc();
+}
+
+void get_light_readings(LightReadings* readings_out) {
+  readings_out->valid = readings.valid;
+  readings_out->raw = readings.raw;
+  readings_out->filtered = readings.filtered;
+  readings_out->level = readings.level;
+}
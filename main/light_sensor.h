@@ -0,0 +1,24 @@
+#ifndef LIGHT_SENSOR_H_
+#define LIGHT_SENSOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "light_rules.h"
+#include "stepper.h"
+
+typedef struct {
+  bool valid;         // False until the first sample period has elapsed
+  uint16_t raw;       // Average of the ADC samples in the last sample period
+  uint16_t filtered;  // Output of the filter
+  LightLevel level;
+} LightReadings;
+
+// Starts sampling the photoresistor in continuous ADC mode and moves the
+// blind through the stepper task when the light level changes.
+esp_err_t start_light_sensor_task(Context* const context);
+
+void get_light_readings(LightReadings* readings);
+
+#endif  // LIGHT_SENSOR_H_
@@ -1,5 +1,6 @@
 #include <sys/param.h>
 
+#include "buttons.h"
 #include "esp_err.h"
 #include "esp_eth.h"
 #include "esp_event.h"
@@ -9,6 +10,9 @@
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "freertos/task.h"
+#include "history.h"
+#include "light_sensor.h"
+#include "mqtt_bridge.h"
 #include "server.h"
 #include "state.h"
 #include "stepper.h"
@@ -39,12 +43,30 @@ void app_main(void) {
   configASSERT(context.semaphore != NULL);
   xSemaphoreGive(context.semaphore);
 
-  PRINT_ERROR_OR_SUCCESS(wifi_init_sta(), "Initialized Wifi.",
-                         "Failed to initialize Wifi.");
+  // Everything that works without the network starts before Wifi, which
+  // blocks until connected.
   PRINT_ERROR_OR_SUCCESS(init_storage_and_state(&context.state),
                          "Initialized state.", "Init state failed");
+  PRINT_ERROR_OR_SUCCESS(start_history_task(), "History task started",
+                         "Failed to start history task");
   PRINT_ERROR_OR_SUCCESS(start_stepper_task(&context), "Stepper task started",
                          "Failed to start stepper task");
+#if CONFIG_LIGHT_SENSOR_ENABLE
+  PRINT_ERROR_OR_SUCCESS(start_light_sensor_task(&context),
+                         "Light sensor task started",
+                         "Failed to start light sensor task");
+#endif  // CONFIG_LIGHT_SENSOR_ENABLE
+#if CONFIG_BUTTONS_ENABLE
+  PRINT_ERROR_OR_SUCCESS(start_button_task(&context), "Button task started",
+                         "Failed to start button task");
+#endif  // CONFIG_BUTTONS_ENABLE
+
+  PRINT_ERROR_OR_SUCCESS(wifi_init_sta(), "Initialized Wifi.",
+                         "Failed to initialize Wifi.");
   PRINT_ERROR_OR_SUCCESS(start_restful_server(&context), "Server started",
                          "Failed to start server.");
+#if CONFIG_MQTT_ENABLE
+  PRINT_ERROR_OR_SUCCESS(start_mqtt_client(&context), "MQTT client started",
+                         "Failed to start MQTT client");
+#endif  // CONFIG_MQTT_ENABLE
 }
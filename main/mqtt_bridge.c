@@ -0,0 +1,314 @@
+#include "mqtt_bridge.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cJSON.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+#include "stepper.h"
+
+#define TAG CONFIG_LOGGING_TAG
+#define MAX_TOPIC (128)
+#define MAX_PAYLOAD (16)
+#define STACK_SIZE 4096
+#define QUEUE_LENGTH 8
+#define STATE_QOS CONFIG_MQTT_STATE_QOS
+#define COMMAND_QOS CONFIG_MQTT_COMMAND_QOS
+#define ONLINE "online"
+#define OFFLINE "offline"
+
+typedef struct {
+  MoveRecord record;
+  State state;
+} MoveMessage;
+
+static esp_mqtt_client_handle_t client = NULL;
+// Moves from the stepper task waiting to be handed to the client.
+static QueueHandle_t move_queue = NULL;
+static esp_timer_handle_t reconnect_timer = NULL;
+static int64_t reconnect_delay_ms = CONFIG_MQTT_RECONNECT_MIN_MS;
+
+static char device_id[32];
+static char availability_topic[MAX_TOPIC];
+static char state_topic[MAX_TOPIC];
+static char event_topic[MAX_TOPIC];
+static char command_topic[MAX_TOPIC];
+static char set_position_topic[MAX_TOPIC];
+static char discovery_topic[MAX_TOPIC];
+
+static void init_topics(void) {
+  if (strlen(CONFIG_MQTT_DEVICE_ID) > 0) {
+    snprintf(device_id, sizeof(device_id), "%s", CONFIG_MQTT_DEVICE_ID);
+  } else {
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(device_id, sizeof(device_id), "blind_%02x%02x%02x", mac[3],
+             mac[4], mac[5]);
+  }
+
+#define FORMAT_TOPIC(buf, suffix)                                     \
+  snprintf((buf), sizeof(buf), "%s/%s/%s", CONFIG_MQTT_TOPIC_PREFIX, \
+           device_id, (suffix))
+  FORMAT_TOPIC(availability_topic, "availability");
+  FORMAT_TOPIC(state_topic, "state");
+  FORMAT_TOPIC(event_topic, "event");
+  FORMAT_TOPIC(command_topic, "command");
+  FORMAT_TOPIC(set_position_topic, "set_position");
+#undef FORMAT_TOPIC
+  snprintf(discovery_topic, sizeof(discovery_topic), "%s/cover/%s/config",
+           CONFIG_MQTT_DISCOVERY_PREFIX, device_id);
+}
+
+// Queues the JSON to be sent by the MQTT task. Takes ownership of root.
+static void enqueue_json(const char* topic, cJSON* root, int qos,
+                         bool retain) {
+  const char* json = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  if (json == NULL) {
+    ESP_LOGE(TAG, "Failed to format MQTT message for %s", topic);
+    return;
+  }
+  if (esp_mqtt_client_enqueue(client, topic, json, /*len=*/0, qos, retain,
+                              /*store=*/true) < 0) {
+    ESP_LOGE(TAG, "Failed to queue MQTT message for %s", topic);
+  }
+  free((void*)json);
+}
+
+static void publish_state(const State* state) {
+  cJSON* root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "max_steps", state->max_steps);
+  cJSON_AddNumberToObject(root, "current_steps", state->current_step);
+  if (state->max_steps > 0 && state->current_step >= 0) {
+    cJSON_AddNumberToObject(
+        root, "position",
+        (100 * state->current_step + state->max_steps / 2) / state->max_steps);
+  }
+  enqueue_json(state_topic, root, STATE_QOS, /*retain=*/true);
+}
+
+#if CONFIG_MQTT_DISCOVERY
+static void publish_discovery(void) {
+  cJSON* root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "name", device_id);
+  cJSON_AddStringToObject(root, "unique_id", device_id);
+  cJSON_AddStringToObject(root, "device_class", "blind");
+  cJSON_AddStringToObject(root, "availability_topic", availability_topic);
+  cJSON_AddStringToObject(root, "command_topic", command_topic);
+  cJSON_AddStringToObject(root, "payload_open", "OPEN");
+  cJSON_AddStringToObject(root, "payload_close", "CLOSE");
+  cJSON_AddStringToObject(root, "payload_stop", "STOP");
+  // Same as the REST integration, which controls the blind by tilt. Both ends
+  // of the travel close the blind, so open is in between.
+  cJSON_AddStringToObject(root, "tilt_command_topic", set_position_topic);
+  cJSON_AddNumberToObject(root, "tilt_opened_value",
+                          CONFIG_MQTT_OPEN_POSITION);
+  cJSON_AddNumberToObject(root, "tilt_closed_value", 0);
+  cJSON_AddStringToObject(root, "tilt_status_topic", state_topic);
+  cJSON_AddStringToObject(root, "tilt_status_template",
+                          "{{ value_json.position }}");
+  cJSON_AddNumberToObject(root, "qos", COMMAND_QOS);
+  cJSON* device = cJSON_AddObjectToObject(root, "device");
+  cJSON* identifiers = cJSON_AddArrayToObject(device, "identifiers");
+  cJSON_AddItemToArray(identifiers, cJSON_CreateString(device_id));
+  cJSON_AddStringToObject(device, "name", device_id);
+  cJSON_AddStringToObject(device, "manufacturer", "SmartBlinds");
+  enqueue_json(discovery_topic, root, STATE_QOS, /*retain=*/true);
+}
+#endif  // CONFIG_MQTT_DISCOVERY
+
+static bool topic_equals(const esp_mqtt_event_handle_t event,
+                         const char* topic) {
+  return event->topic_len == (int)strlen(topic) &&
+         strncmp(event->topic, topic, event->topic_len) == 0;
+}
+
+static void handle_command(Context* context, esp_mqtt_event_handle_t event) {
+  // Commands are tiny, anything fragmented is not one of ours.
+  if (event->current_data_offset != 0 || event->data_len >= MAX_PAYLOAD) {
+    ESP_LOGE(TAG, "Ignoring oversized MQTT message");
+    return;
+  }
+  char payload[MAX_PAYLOAD];
+  memcpy(payload, event->data, event->data_len);
+  payload[event->data_len] = '\0';
+  ESP_LOGI(TAG, "MQTT message: %.*s %s", event->topic_len, event->topic,
+           payload);
+
+  if (topic_equals(event, command_topic)) {
+    if (strcmp(payload, "OPEN") == 0) {
+      log_move_error("MQTT OPEN",
+                     try_move_to_fraction(context,
+                                          CONFIG_MQTT_OPEN_POSITION / 100.0));
+    } else if (strcmp(payload, "CLOSE") == 0) {
+      log_move_error("MQTT CLOSE", try_move_to_fraction(context, 0.0));
+    } else if (strcmp(payload, "STOP") == 0) {
+      stop_stepper(context);
+    } else {
+      ESP_LOGE(TAG, "Unknown MQTT command: %s", payload);
+    }
+  } else if (topic_equals(event, set_position_topic)) {
+    char* end = NULL;
+    const long position = strtol(payload, &end, 10);
+    if (end == payload || *end != '\0' || position < 0 || position > 100) {
+      ESP_LOGE(TAG, "Invalid position: %s", payload);
+      return;
+    }
+    log_move_error("MQTT set_position",
+                   try_move_to_fraction(context, position / 100.0));
+  }
+}
+
+static void reconnect_timer_callback(void* parameter) {
+  ESP_LOGI(TAG, "Reconnecting to MQTT broker");
+  esp_mqtt_client_reconnect(client);
+}
+
+static void schedule_reconnect(void) {
+  ESP_LOGI(TAG, "MQTT disconnected, retry in %" PRId64 " ms",
+           reconnect_delay_ms);
+  esp_timer_stop(reconnect_timer);
+  esp_timer_start_once(reconnect_timer, reconnect_delay_ms * 1000);
+  reconnect_delay_ms =
+      MIN(reconnect_delay_ms * 2, CONFIG_MQTT_RECONNECT_MAX_MS);
+}
+
+static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
+                               int32_t event_id, void* event_data) {
+  Context* const context = (Context*)handler_args;
+  const esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
+  switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_CONNECTED:
+      ESP_LOGI(TAG, "Connected to MQTT broker");
+      reconnect_delay_ms = CONFIG_MQTT_RECONNECT_MIN_MS;
+      esp_mqtt_client_subscribe(client, command_topic, COMMAND_QOS);
+      esp_mqtt_client_subscribe(client, set_position_topic, COMMAND_QOS);
+      esp_mqtt_client_enqueue(client, availability_topic, ONLINE, /*len=*/0,
+                              STATE_QOS, /*retain=*/true, /*store=*/true);
+#if CONFIG_MQTT_DISCOVERY
+      publish_discovery();
+#endif  // CONFIG_MQTT_DISCOVERY
+      // Only updated by the stepper task. At worst this is the state from
+      // before a move that is about to publish its own.
+      publish_state(&context->state);
+      break;
+    case MQTT_EVENT_DISCONNECTED:
+      schedule_reconnect();
+      break;
+    case MQTT_EVENT_DATA:
+      handle_command(context, event);
+      break;
+    case MQTT_EVENT_ERROR:
+      ESP_LOGE(TAG, "MQTT error");
+      break;
+    default:
+      break;
+  }
+}
+
+static void publish_move(const MoveRecord* record, const State* state) {
+  cJSON* root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "timestamp", record->timestamp);
+  cJSON_AddNumberToObject(root, "start_step", record->start_step);
+  cJSON_AddNumberToObject(root, "end_step", record->end_step);
+  cJSON_AddNumberToObject(root, "duration_ms", record->duration_ms);
+  cJSON_AddBoolToObject(root, "interrupted", record->interrupted);
+  enqueue_json(event_topic, root, STATE_QOS, /*retain=*/false);
+  publish_state(state);
+}
+
+// Hands moves to the client. esp_mqtt_client_enqueue takes the client lock,
+// which the MQTT task can hold through a blocking connect while the broker is
+// unreachable, so the stepper task must never call it directly.
+void mqtt_publish_task(void* parameter) {
+  MoveMessage message;
+  while (true) {
+    if (xQueueReceive(move_queue, &message, portMAX_DELAY) == pdTRUE) {
+      publish_move(&message.record, &message.state);
+    }
+  }
+}
+
+esp_err_t start_mqtt_client(Context* const context) {
+  if (context == NULL) {
+    return ESP_FAIL;
+  }
+  init_topics();
+
+  move_queue = xQueueCreate(QUEUE_LENGTH, sizeof(MoveMessage));
+  if (move_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create MQTT queue");
+    return ESP_FAIL;
+  }
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = &reconnect_timer_callback,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "MQTT Reconnect Timer"};
+  esp_err_t err = esp_timer_create(&timer_args, &reconnect_timer);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to create MQTT reconnect timer");
+    return err;
+  }
+
+  const esp_mqtt_client_config_t config = {
+      .broker.address.uri = CONFIG_MQTT_BROKER_URI,
+      .credentials =
+          {
+              .client_id = device_id,
+              .username = strlen(CONFIG_MQTT_USERNAME) > 0
+                              ? CONFIG_MQTT_USERNAME
+                              : NULL,
+              .authentication.password = strlen(CONFIG_MQTT_PASSWORD) > 0
+                                             ? CONFIG_MQTT_PASSWORD
+                                             : NULL,
+          },
+      .session.last_will = {.topic = availability_topic,
+                            .msg = OFFLINE,
+                            .qos = STATE_QOS,
+                            .retain = true},
+      // Reconnects are scheduled with backoff by the event handler.
+      .network.disable_auto_reconnect = true,
+  };
+  client = esp_mqtt_client_init(&config);
+  if (client == NULL) {
+    ESP_LOGE(TAG, "Failed to create MQTT client");
+    return ESP_FAIL;
+  }
+  err = esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID,
+                                       &mqtt_event_handler, context);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to register MQTT event handler");
+    return err;
+  }
+
+  TaskHandle_t task_handle = NULL;
+  xTaskCreate(&mqtt_publish_task, "mqtt_publish_task", STACK_SIZE, NULL,
+              tskIDLE_PRIORITY + 1, &task_handle);
+  if (task_handle == NULL) {
+    ESP_LOGE(TAG, "Failed to create MQTT publish task");
+    return ESP_FAIL;
+  }
+  return esp_mqtt_client_start(client);
+}
+
+void mqtt_publish_move(const MoveRecord* record, const State* state) {
+  if (move_queue == NULL) {
+    return;
+  }
+  const MoveMessage message = {.record = *record, .state = *state};
+  if (xQueueSend(move_queue, &message, (TickType_t)0) != pdTRUE) {
+    ESP_LOGE(TAG, "MQTT queue full, dropping move");
+  }
+}
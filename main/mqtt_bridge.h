@@ -0,0 +1,40 @@
+#ifndef MQTT_BRIDGE_H_
+#define MQTT_BRIDGE_H_
+
+#include "esp_err.h"
+#include "history.h"
+#include "sdkconfig.h"
+#include "state.h"
+#include "stepper.h"
+
+#if CONFIG_MQTT_ENABLE
+
+// Connects to CONFIG_MQTT_BROKER_URI. All topics are under
+// <CONFIG_MQTT_TOPIC_PREFIX>/<device id>:
+//
+//  * availability  Retained "online", or "offline" as the last will.
+//  * state         Retained {"max_steps", "current_steps", "position"}.
+//  * event         {"timestamp", "start_step", "end_step", "duration_ms",
+//                  "interrupted"} for every completed move.
+//  * command       Subscribed. "OPEN" moves to CONFIG_MQTT_OPEN_POSITION,
+//                  "CLOSE" to 0 and "STOP" ends the current move.
+//  * set_position  Subscribed. Integer percentage of max_steps.
+//
+// Also publishes a Home Assistant MQTT discovery config for the cover.
+esp_err_t start_mqtt_client(Context* const context);
+
+// Publishes the move event and the new state from a separate task. Never
+// blocks, so the stepper task can call it while holding the motion semaphore.
+// Drops the move if the queue to that task is full. Does nothing before the
+// client is started.
+void mqtt_publish_move(const MoveRecord* record, const State* state);
+
+#else  // CONFIG_MQTT_ENABLE
+
+// mqtt_bridge.c is only built with CONFIG_MQTT_ENABLE.
+static inline void mqtt_publish_move(const MoveRecord* record,
+                                     const State* state) {}
+
+#endif  // CONFIG_MQTT_ENABLE
+
+#endif  // MQTT_BRIDGE_H_
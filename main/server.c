@@ -1,6 +1,8 @@
 #include "server.h"
 
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cJSON.h"
@@ -12,30 +14,35 @@
 #include "esp_vfs.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "history.h"
+#include "light_sensor.h"
 #include "state.h"
 #include "stepper.h"
 
 #define TAG CONFIG_LOGGING_TAG
 #define MAX_BUFFER (1024)
+#define MAX_QUERY (128)
+#define HISTORY_CHUNK (512)
+
+#define GET_CONTEXT_OR_RETURN(req_expr)                          \
+  ({                                                             \
+    httpd_req_t *const req_ = (req_expr);                        \
+    Context *context = (Context *)req_->user_ctx;                \
+    if (context == NULL) {                                       \
+      httpd_resp_send_err(req_, HTTPD_500_INTERNAL_SERVER_ERROR, \
+                          "Context is NULL");                    \
+      return ESP_FAIL;                                           \
+    }                                                            \
+    context;                                                     \
+  })
 
 #define TAKE_SEMAPHORE_AND_GET_CONTEXT_OR_RETURN(req_expr)             \
   ({                                                                   \
     httpd_req_t *const req_ = (req_expr);                              \
-    Context *context = (Context *)req_->user_ctx;                      \
-    if (context == NULL) {                                             \
-      httpd_resp_send_err(req_, HTTPD_500_INTERNAL_SERVER_ERROR,       \
-                          "Context is NULL");                          \
-      return ESP_FAIL;                                                 \
-    }                                                                  \
+    Context *context = GET_CONTEXT_OR_RETURN(req_);                    \
     ESP_LOGI(TAG, "Take Semaphore");                                   \
     if (xSemaphoreTake(context->semaphore, (TickType_t)0) != pdTRUE) { \
-      cJSON *root = cJSON_CreateObject();                              \
-      cJSON_AddStringToObject(root, "msg", "Stepper is still moving"); \
-      const char *json = cJSON_Print(root);                            \
-      httpd_resp_sendstr(req_, json);                                  \
-      free((void *)json);                                              \
-      cJSON_Delete(root);                                              \
-      return ESP_OK;                                                   \
+      return send_stepper_busy(req_);                                  \
     }                                                                  \
     context;                                                           \
   })
@@ -75,6 +82,41 @@
     root;                                                                \
   })
 
+static esp_err_t send_stepper_busy(httpd_req_t *req) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "msg", "Stepper is still moving");
+  const char *json = cJSON_Print(root);
+  httpd_resp_sendstr(req, json);
+  free((void *)json);
+  cJSON_Delete(root);
+  return ESP_OK;
+}
+
+// Sends the response for the result of try_move_steps or
+// try_move_to_fraction.
+static esp_err_t send_move_result(httpd_req_t *req, esp_err_t err) {
+  switch (err) {
+    case ESP_OK:
+      RETURN_OK(req);
+    case ESP_ERR_TIMEOUT:
+      return send_stepper_busy(req);
+    case ESP_ERR_INVALID_ARG:
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid fraction.");
+      ESP_LOGE(TAG, "Fraction out of [0, 1] range.");
+      return ESP_FAIL;
+    case ESP_ERR_INVALID_STATE:
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                          "State uninitialized.");
+      ESP_LOGE(TAG, "State uninitialized");
+      return ESP_FAIL;
+    default:
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                          "Failed to move.");
+      ESP_LOGE(TAG, "Failed to move: %s", esp_err_to_name(err));
+      return ESP_FAIL;
+  }
+}
+
 static esp_err_t get_request_buffer(httpd_req_t *req, char *buf,
                                     size_t max_len) {
   int total_len = req->content_len;
@@ -148,10 +190,8 @@ static esp_err_t unsafe_move_steps_put_handler(httpd_req_t *req) {
 
   // Move the stepper.
 
-  Context *const context = TAKE_SEMAPHORE_AND_GET_CONTEXT_OR_RETURN(req);
-  context->steps = steps;
-  xTaskNotifyGive(context->stepper_task_handle);
-  RETURN_OK(req);
+  Context *const context = GET_CONTEXT_OR_RETURN(req);
+  return send_move_result(req, try_move_steps(context, steps));
 }
 
 static esp_err_t move_to_fraction_put_handler(httpd_req_t *req) {
@@ -165,26 +205,10 @@ static esp_err_t move_to_fraction_put_handler(httpd_req_t *req) {
   const double fraction = cJSON_GetObjectItem(root, "fraction")->valuedouble;
   cJSON_Delete(root);
 
-  if (fraction < 0 || fraction > 1) {
-    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid fraction.");
-    ESP_LOGE(TAG, "Fraction out of [0, 1] range. Got: %03f", fraction);
-    return ESP_FAIL;
-  }
-
   // Move the stepper.
 
-  Context *const context = TAKE_SEMAPHORE_AND_GET_CONTEXT_OR_RETURN(req);
-  if (context->state.max_steps < 0 || context->state.current_step < 0) {
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
-                        "State uninitialized.");
-    ESP_LOGE(TAG, "State uninitialized");
-    xSemaphoreGive(context->semaphore);
-    return ESP_FAIL;
-  }
-  context->steps =
-      (int)(fraction * context->state.max_steps) - context->state.current_step;
-  xTaskNotifyGive(context->stepper_task_handle);
-  RETURN_OK(req);
+  Context *const context = GET_CONTEXT_OR_RETURN(req);
+  return send_move_result(req, try_move_to_fraction(context, fraction));
 }
 
 static esp_err_t reset_state_put_handler(httpd_req_t *req) {
@@ -205,6 +229,143 @@ static esp_err_t reset_state_put_handler(httpd_req_t *req) {
   RETURN_OK(req);
 }
 
+// Parses an integer query parameter. Leaves value untouched if it's missing.
+// A truncated value is an error rather than missing.
+static esp_err_t get_query_int(const char *query, const char *key,
+                               int64_t *value) {
+  char param[32];
+  const esp_err_t err =
+      httpd_query_key_value(query, key, param, sizeof(param));
+  if (err == ESP_ERR_NOT_FOUND) {
+    return ESP_OK;
+  }
+  if (err != ESP_OK) {
+    return err;
+  }
+  char *end = NULL;
+  const long long parsed = strtoll(param, &end, 10);
+  if (end == param || *end != '\0') {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *value = parsed;
+  return ESP_OK;
+}
+
+// Records are formatted into a buffer which is sent as one HTTP chunk when
+// full, so the history is never held in memory as a whole.
+typedef struct {
+  httpd_req_t *req;
+  char buf[HISTORY_CHUNK];
+  size_t len;
+  bool first;
+} HistoryStream;
+
+static esp_err_t flush_history_stream(HistoryStream *stream) {
+  if (stream->len == 0) {
+    return ESP_OK;
+  }
+  const esp_err_t err =
+      httpd_resp_send_chunk(stream->req, stream->buf, stream->len);
+  stream->len = 0;
+  return err;
+}
+
+static esp_err_t append_history_record(const MoveRecord *record, void *arg) {
+  HistoryStream *const stream = (HistoryStream *)arg;
+  char entry[160];
+  const int len = snprintf(
+      entry, sizeof(entry),
+      "%s{\"timestamp\": %" PRId64
+      ", \"start_step\": %d, \"end_step\": %d, \"duration_ms\": %" PRIu32
+      ", \"interrupted\": %s}",
+      stream->first ? "" : ",\n", (int64_t)record->timestamp,
+      record->start_step, record->end_step, record->duration_ms,
+      record->interrupted ? "true" : "false");
+  stream->first = false;
+  if (stream->len + len > sizeof(stream->buf)) {
+    const esp_err_t err = flush_history_stream(stream);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  memcpy(stream->buf + stream->len, entry, len);
+  stream->len += len;
+  return ESP_OK;
+}
+
+static esp_err_t history_get_handler(httpd_req_t *req) {
+  int64_t from = 0;
+  int64_t to = INT64_MAX;
+  char query[MAX_QUERY];
+  const esp_err_t query_err =
+      httpd_req_get_url_query_str(req, query, sizeof(query));
+  if (query_err != ESP_OK && query_err != ESP_ERR_NOT_FOUND) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Query too long.");
+    return ESP_FAIL;
+  }
+  if (query_err == ESP_OK) {
+    if (get_query_int(query, "from", &from) != ESP_OK ||
+        get_query_int(query, "to", &to) != ESP_OK) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid range.");
+      return ESP_FAIL;
+    }
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  HistoryStream *stream = malloc(sizeof(HistoryStream));
+  if (stream == NULL) {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                        "Out of memory.");
+    return ESP_FAIL;
+  }
+  stream->req = req;
+  stream->len = 0;
+  stream->first = true;
+
+  esp_err_t err = httpd_resp_send_chunk(req, "[", HTTPD_RESP_USE_STRLEN);
+  if (err == ESP_OK) {
+    err = read_history((time_t)from, (time_t)to, &append_history_record,
+                       stream);
+  }
+  if (err == ESP_OK) {
+    err = flush_history_stream(stream);
+  }
+  free(stream);
+  if (err != ESP_OK) {
+    // Headers are already sent, so all that can be done is to cut the
+    // response short.
+    ESP_LOGE(TAG, "Failed to stream history");
+    return ESP_FAIL;
+  }
+  httpd_resp_send_chunk(req, "]", HTTPD_RESP_USE_STRLEN);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+#if CONFIG_LIGHT_SENSOR_ENABLE
+static esp_err_t light_get_handler(httpd_req_t *req) {
+  httpd_resp_set_type(req, "application/json");
+  LightReadings readings;
+  get_light_readings(&readings);
+  if (!readings.valid) {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                        "No light reading yet.");
+    return ESP_FAIL;
+  }
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "raw", readings.raw);
+  cJSON_AddNumberToObject(root, "filtered", readings.filtered);
+  cJSON_AddStringToObject(root, "level",
+                          readings.level == LIGHT_LEVEL_BRIGHT ? "bright"
+                          : readings.level == LIGHT_LEVEL_DARK ? "dark"
+                                                               : "unknown");
+  const char *json = cJSON_Print(root);
+  httpd_resp_sendstr(req, json);
+  free((void *)json);
+  cJSON_Delete(root);
+  return ESP_OK;
+}
+#endif  // CONFIG_LIGHT_SENSOR_ENABLE
+
 esp_err_t start_restful_server(Context *context) {
   if (context == NULL) {
     ESP_LOGE(TAG, "Context pointer is NULL");
@@ -274,5 +435,33 @@ esp_err_t start_restful_server(Context *context) {
                                      .user_ctx = context};
   httpd_register_uri_handler(server, &reset_state_put_uri);
 
+  // Query: ?from=<unix time>&to=<unix time>, both optional and inclusive.
+  // Response:
+  // [
+  //    {
+  //       "timestamp": int  // Start of the move, unix time
+  //       "start_step": int
+  //       "end_step": int
+  //       "duration_ms": int
+  //       "interrupted": bool  // Stopped before reaching the target
+  //    },
+  //    ...
+  // ]
+  httpd_uri_t history_get_uri = {
+      .uri = "/history", .method = HTTP_GET, .handler = history_get_handler};
+  httpd_register_uri_handler(server, &history_get_uri);
+
+#if CONFIG_LIGHT_SENSOR_ENABLE
+  // Response:
+  // {
+  //    "raw": int  // Averaged ADC reading of the last sample period
+  //    "filtered": int  // Filtered reading the rules are checked against
+  //    "level": str  // "bright", "dark" or "unknown"
+  // }
+  httpd_uri_t light_get_uri = {
+      .uri = "/light", .method = HTTP_GET, .handler = light_get_handler};
+  httpd_register_uri_handler(server, &light_get_uri);
+#endif  // CONFIG_LIGHT_SENSOR_ENABLE
+
   return ESP_OK;
 }
\ No newline at end of file
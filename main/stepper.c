@@ -1,13 +1,17 @@
 #include "stepper.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "history.h"
+#include "mqtt_bridge.h"
 #include "sdkconfig.h"
 
 #define TAG CONFIG_LOGGING_TAG
@@ -34,6 +38,7 @@ typedef struct {
   const uint16_t end;
   const int16_t direction;
   const TaskHandle_t stepper_task_handle;
+  volatile bool* const stop_requested;
   int64_t step;
 } TimerState;
 
@@ -42,7 +47,7 @@ static const uint8_t pin_states[] = {0b1010, 0b0110, 0b0101, 0b1001};
 void timer_callback(void* parameter) {
   configASSERT(parameter != NULL);
   TimerState* const timer_state = (TimerState*)parameter;
-  if (timer_state->step == timer_state->end) {
+  if (timer_state->step == timer_state->end || *timer_state->stop_requested) {
     vTaskNotifyGiveFromISR(timer_state->stepper_task_handle,
                            /*pxHigherPriorityTaskWoken=*/NULL);
     return;
@@ -66,6 +71,7 @@ void stepper_task(void* parameter) {
                     /*clear notification on exit*/ ULONG_MAX,
                     /*pulNotificationValue=*/NULL, portMAX_DELAY);
     gpio_set_level(context->stepper.led_pin, 1);
+    context->stop_requested = false;
 
     // Delete state so if it somehow fails in the middle, the state won't be
     // inconsistent.
@@ -75,6 +81,7 @@ void stepper_task(void* parameter) {
         (context->stepper.steps_per_rav * context->stepper.rpm);
     const int64_t delay_us = (60L * 1e6L + steps_per_min - 1) / steps_per_min;
     const int32_t steps = context->steps;
+    const int64_t start_step = steps > 0 ? 0 : -steps;
     TimerState timer_state = {
         .pin1 = context->stepper.pin1,
         .pin2 = context->stepper.pin2,
@@ -83,7 +90,8 @@ void stepper_task(void* parameter) {
         .end = steps > 0 ? steps : 0,
         .direction = steps > 0 ? 1 : -1,
         .stepper_task_handle = context->stepper_task_handle,
-        .step = steps > 0 ? 0 : -steps};
+        .stop_requested = &context->stop_requested,
+        .step = start_step};
 
     // Start timer for stepping
 
@@ -95,6 +103,9 @@ void stepper_task(void* parameter) {
 
     ESP_LOGD(TAG, "Start timer");
 
+    const time_t start_time = time(NULL);
+    const int64_t start_us = esp_timer_get_time();
+
     configASSERT(esp_timer_create(&timer_args, &timer_handle) == ESP_OK);
     configASSERT(esp_timer_start_periodic(timer_handle, delay_us) == ESP_OK);
 
@@ -106,6 +117,8 @@ void stepper_task(void* parameter) {
 
     ESP_LOGD(TAG, "Finished rotation");
 
+    const int64_t duration_us = esp_timer_get_time() - start_us;
+
     configASSERT(esp_timer_stop(timer_handle) == ESP_OK);
     configASSERT(esp_timer_delete(timer_handle) == ESP_OK);
 
@@ -114,15 +127,21 @@ void stepper_task(void* parameter) {
     gpio_set_level(context->stepper.pin3, 0);
     gpio_set_level(context->stepper.pin4, 0);
 
-    // Update state
+    // Update state. The move may have been stopped before reaching the end.
 
+    const int32_t moved = (int32_t)(timer_state.step - start_step);
+    if (moved != steps) {
+      ESP_LOGI(TAG, "Stopped after %" PRId32 " of %" PRId32 " steps", moved,
+               steps);
+    }
     State* state = &context->state;
     if (state->max_steps < 0 || state->current_step < 0) {
       ESP_LOGI(TAG, "Initialize state");
       state->max_steps = 0;
       state->current_step = 0;
     }
-    state->current_step += steps;
+    const int16_t start_current_step = state->current_step;
+    state->current_step += moved;
     if (state->current_step >= state->max_steps) {
       state->max_steps = state->current_step;
     }
@@ -132,6 +151,16 @@ void stepper_task(void* parameter) {
     }
     write_state_to_file(&context->state);
 
+    const MoveRecord record = {.timestamp = start_time,
+                               .start_step = start_current_step,
+                               .end_step = state->current_step,
+                               .duration_ms = duration_us / 1000,
+                               .interrupted = moved != steps};
+    if (log_move(&record) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to log move to history");
+    }
+    mqtt_publish_move(&record, state);
+
     xSemaphoreGive(context->semaphore);
   }
 }
@@ -149,3 +178,57 @@ esp_err_t start_stepper_task(Context* const context) {
   }
   return ESP_OK;
 }
+
+esp_err_t try_move_steps(Context* const context, int32_t steps) {
+  if (xSemaphoreTake(context->semaphore, (TickType_t)0) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  context->steps = steps;
+  xTaskNotifyGive(context->stepper_task_handle);
+  return ESP_OK;
+}
+
+esp_err_t try_move_steps_clamped(Context* const context, int32_t steps) {
+  if (xSemaphoreTake(context->semaphore, (TickType_t)0) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  const State* const state = &context->state;
+  if (state->max_steps >= 0 && state->current_step >= 0) {
+    const int32_t target = state->current_step + steps;
+    if (target < 0) {
+      steps = -state->current_step;
+    } else if (target > state->max_steps) {
+      steps = state->max_steps - state->current_step;
+    }
+  }
+  context->steps = steps;
+  xTaskNotifyGive(context->stepper_task_handle);
+  return ESP_OK;
+}
+
+esp_err_t try_move_to_fraction(Context* const context, double fraction) {
+  if (fraction < 0 || fraction > 1) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (xSemaphoreTake(context->semaphore, (TickType_t)0) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  if (context->state.max_steps < 0 || context->state.current_step < 0) {
+    xSemaphoreGive(context->semaphore);
+    return ESP_ERR_INVALID_STATE;
+  }
+  context->steps =
+      (int)(fraction * context->state.max_steps) - context->state.current_step;
+  xTaskNotifyGive(context->stepper_task_handle);
+  return ESP_OK;
+}
+
+void log_move_error(const char* source, esp_err_t err) {
+  if (err == ESP_ERR_TIMEOUT) {
+    ESP_LOGI(TAG, "%s ignored, stepper is still moving", source);
+  } else if (err != ESP_OK) {
+    ESP_LOGE(TAG, "%s failed: %s", source, esp_err_to_name(err));
+  }
+}
+
+void stop_stepper(Context* const context) { context->stop_requested = true; }
@@ -33,8 +33,36 @@ typedef struct {
   // Stepper task is only responsbile for giving it. Server task should return
   // if failed to take.
   SemaphoreHandle_t semaphore;
+
+  // Set to end the current move early. Cleared by the stepper task when a move
+  // starts. Safe to set from an ISR.
+  volatile bool stop_requested;
 } Context;
 
 esp_err_t start_stepper_task(Context* const context);
 
+// Starts moving by `steps` if the stepper is idle. Returns ESP_ERR_TIMEOUT if
+// another move is in progress. All moves, REST or otherwise, start through
+// these functions.
+esp_err_t try_move_steps(Context* const context, int32_t steps);
+
+// Same as try_move_steps, but once the state is initialized the move is
+// clamped so it stays within [0, max_steps]. The state is read after taking
+// the semaphore, so it can't change under the clamp.
+esp_err_t try_move_steps_clamped(Context* const context, int32_t steps);
+
+// Starts moving to `fraction` of max_steps if the stepper is idle. Returns
+// ESP_ERR_INVALID_ARG if fraction is out of [0, 1], ESP_ERR_INVALID_STATE if
+// the state is uninitialized and ESP_ERR_TIMEOUT if another move is in
+// progress.
+esp_err_t try_move_to_fraction(Context* const context, double fraction);
+
+// Logs the result of one of the try_move functions for `source`, e.g.
+// "Button step". A busy stepper is expected and only logged as info.
+void log_move_error(const char* source, esp_err_t err);
+
+// Ends the current move, if any. The state is updated with the steps actually
+// taken.
+void stop_stepper(Context* const context);
+
 #endif  // STEPPER_H_
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "esp_event.h"
 #include "esp_event_base.h"
 #include "esp_log.h"
+#include "esp_sntp.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
@@ -73,6 +74,10 @@ esp_err_t wifi_init_sta(void) {
   // can test which event actually happened.
   if (bits & WIFI_CONNECTED_BIT) {
     ESP_LOGI(TAG, "Connected to SSID: %s", CONFIG_WIFI_SSID);
+    // Move history is timestamped with the wall clock.
+    esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, CONFIG_SNTP_SERVER);
+    esp_sntp_init();
   } else if (bits & WIFI_FAIL_BIT) {
     ESP_LOGD(TAG, "Failed to connect to SSID: %s, Password: %s",
              CONFIG_WIFI_SSID, CONFIG_WIFI_PASSWORD);